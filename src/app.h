@@ -0,0 +1,1663 @@
+// Copyright 2016 Steven Dee. All rights reserved.
+
+#pragma once
+
+// Hack around stdlib bug with C++14.
+#include <initializer_list>   // force libstdc++ to include its config
+#undef _GLIBCXX_HAVE_GETS     // correct broken config
+// End hack.
+
+#include <algorithm>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <dirent.h>
+#include <errno.h>
+#include <kj/common.h>
+#include <kj/debug.h>
+#include <kj/string.h>
+#include <kj/vector.h>
+#include <unistd.h>
+
+#include "util.h"
+
+namespace app {
+
+constexpr auto INDEX_PATH = "index.html.gz";
+constexpr auto CHATS_PATH = "var/chats";
+constexpr auto CHATSIZE_PATH = "var/.chatsize";
+constexpr auto CHATINDEX_PATH = "var/.chatindex";
+constexpr auto SEARCH_PATH = "var/.chatsearch";
+constexpr auto TOPIC_PATH = "var/topic";
+
+constexpr auto COMMIT_WINDOW = 2 * kj::MILLISECONDS;
+constexpr uint64_t SEGMENT_SIZE = 1 << 20;
+constexpr size_t MAX_SOCKET_MESSAGE = 64 * 1024;
+constexpr size_t MAX_SOCKET_SENDS = 4;
+constexpr auto LONG_POLL_TIMEOUT = 45 * kj::SECONDS;
+constexpr size_t MAX_POLLS_PER_SESSION = 8;
+constexpr size_t MAX_POLLS = 4096;
+constexpr size_t MAX_WORD_SIZE = 64;
+constexpr size_t MAX_SEARCH_RESULTS = 100;
+constexpr size_t MAX_USER_CHANGES = 1024;
+
+
+struct Update {
+  // What a client holding some cursor is missing.
+  kj::StringPtr kind;   // "full" or "delta"
+  kj::String cursor;
+  kj::Own<u::Snapshot> body;
+};
+
+class ChatStream {
+ public:
+  ChatStream(kj::Timer& timer, uint64_t epoch = 0,
+             kj::Function<void()> drained = []() {}):
+      epoch(epoch), chatQueue(timer, kj::mv(drained)) {}
+
+  uint64_t size() const {
+    return length;
+  }
+
+  kj::String cursor() const {
+    // Opaque to clients. The epoch changes whenever previously-served offsets
+    // stop meaning the same thing, e.g. on an OTR reset.
+    return kj::str(epoch, '.', size());
+  }
+
+  kj::Maybe<uint64_t> offsetFor(kj::StringPtr cursor) const {
+    // Returns the offset a cursor refers to, or null if the client needs a
+    // full resync.
+    KJ_IF_MAYBE(dotPos, cursor.findFirst('.')) {
+      KJ_IF_MAYBE(e, u::tryParseUint(kj::heapString(cursor.slice(0, *dotPos)))) {
+        KJ_IF_MAYBE(offset, u::tryParseUint(cursor.slice(*dotPos + 1))) {
+          if (*e == epoch && *offset <= size())
+            return *offset;
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  kj::Promise<void> onNew() {
+    return chatQueue.wait();
+  }
+
+  size_t waiters() const {
+    return chatQueue.size();
+  }
+
+ protected:
+  bool waking() const {
+    return chatQueue.isDraining();
+  }
+
+  void published(uint64_t bytes) {
+    METRICS_DO(u::metrics().bytesWritten += bytes);
+    length += bytes;
+    fullCache.invalidate();
+    deltaCache.invalidate();
+    chatQueue.ready();
+  }
+
+  void restart() {
+    // Invalidates every outstanding cursor.
+    ++epoch;
+    length = 0;
+    fullCache.invalidate();
+    deltaCache.invalidate();
+    chatQueue.ready();
+  }
+
+  uint64_t length = 0;
+  // Every long-poll parked on the same cursor wakes wanting the same delta.
+  // Subclasses decide what's small enough to keep.
+  u::SnapshotCache fullCache;
+  u::SnapshotCache deltaCache;
+
+ private:
+  uint64_t epoch;
+  u::WaitQueue chatQueue;
+};
+
+class MemStream: public ChatStream {
+ public:
+  // Seed the epoch randomly so cursors held across a grain restart don't
+  // alias offsets in the fresh (empty) stream.
+  MemStream(kj::Timer& timer): ChatStream(timer, u::randomEpoch()) {
+    chatData.add('\0');
+  }
+
+  kj::Own<u::Snapshot> get() {
+    return fullCache.get([this]() {
+      return kj::heapString(chatData.begin(), size());
+    });
+  }
+
+  kj::Own<u::Snapshot> getSince(uint64_t offset) {
+    // Like get(), but only the bytes past offset.
+    return deltaCache.get([this, offset]() {
+      return kj::heapString(chatData.begin() + offset, size() - offset);
+    }, offset);
+  }
+
+  kj::Promise<void> write(kj::StringPtr line) {
+    METRICS_DO(++u::metrics().messagesWritten);
+    // Remove null terminator.
+    chatData.removeLast();
+    chatData.addAll(line);
+    chatData.add('\0');
+    published(line.size());
+    return kj::READY_NOW;
+  }
+
+  void reset() {
+    chatData.clear();
+    chatData.add('\0');
+    restart();
+  }
+
+ private:
+  kj::Vector<char> chatData;
+};
+
+class Transcript {
+  // The logged transcript. On disk it's still one append-only plain-text file,
+  // so grain backups keep a readable log. In memory it's treated as segments
+  // of about SEGMENT_SIZE bytes, each starting on a line boundary. The
+  // segment starts are recorded in a sparse index at CHATINDEX_PATH, one
+  // "<line number> <offset>" per line. Only the last segment stays resident;
+  // reads reaching further back map the file in for the duration of the read.
+ public:
+  Transcript():
+      length(u::readFile(CHATSIZE_PATH).parseAs<uint64_t>()),
+      fd(u::raiiOpen(CHATS_PATH, O_RDWR)) {
+    KJ_SYSCALL(ftruncate(fd, length));
+    entries.add(Entry{0, 0});
+    auto indexOk = loadIndex();
+    if (!indexOk) {
+      KJ_LOG(INFO, "rebuilding chat index", entries.back().offset, length);
+    }
+
+    // Usually just pages in the last segment. Also catches the index up if
+    // it's missing or stale, one segment at a time.
+    auto knownEntries = entries.size();
+    lineCount = entries.back().line;
+    for (auto at = entries.back().offset; at < length; at += SEGMENT_SIZE) {
+      auto oldStart = entries.back().offset;
+      auto chunk = u::mapFile(fd, at, kj::min(SEGMENT_SIZE, length - at));
+      scan(chunk, at);
+      extendTail(chunk, oldStart);
+    }
+    if (!indexOk || entries.size() > knownEntries) {
+      u::writeFileAtomic(CHATINDEX_PATH, formatEntries(1));
+    }
+    indexFd = u::raiiOpen(CHATINDEX_PATH, O_WRONLY | O_APPEND);
+  }
+
+  uint64_t size() const {
+    return length;
+  }
+
+  uint64_t residentFrom() const {
+    // Start of the segment kept in memory.
+    return entries.back().offset;
+  }
+
+  size_t segmentCount() const {
+    // Segments so far; all but the last are closed.
+    return entries.size();
+  }
+
+  uint64_t segmentStart(size_t i) const {
+    return entries[i].offset;
+  }
+
+  kj::String read(uint64_t from) const {
+    // Returns the transcript from offset `from` to the end.
+    return read(from, length);
+  }
+
+  kj::String read(uint64_t from, uint64_t to) const {
+    KJ_REQUIRE(from <= to && to <= length);
+    auto start = entries.back().offset;
+    auto ret = kj::heapString(to - from);
+    auto out = ret.begin();
+    if (from < start) {
+      auto older = u::mapFile(fd, from, kj::min(to, start) - from);
+      memcpy(out, older.begin(), older.size());
+      out += older.size();
+    }
+    if (to > start) {
+      auto tailFrom = kj::max(from, start) - start;
+      memcpy(out, tail.begin() + tailFrom, to - start - tailFrom);
+    }
+    return ret;
+  }
+
+  kj::String readLine(uint64_t offset) const {
+    // Returns the line starting at `offset`, without its newline.
+    KJ_REQUIRE(offset < length);
+    auto start = entries.back().offset;
+    kj::Array<const char> older;
+    kj::ArrayPtr<const char> rest;
+    if (offset < start) {
+      // Segments start on line boundaries, so the line ends within its own.
+      auto next = std::upper_bound(entries.begin(), entries.end(), offset,
+                                   [](uint64_t o, const Entry& e) { return o < e.offset; });
+      older = u::mapFile(fd, offset, next->offset - offset);
+      rest = older;
+    } else {
+      rest = tail.asPtr().slice(offset - start, tail.size());
+    }
+    auto end = reinterpret_cast<const char*>(memchr(rest.begin(), '\n', rest.size()));
+    return kj::heapString(rest.begin(), end == nullptr ? rest.size() : end - rest.begin());
+  }
+
+  void append(kj::ArrayPtr<const char> lines) {
+    // Makes lines durable and advances .chatsize past them. If this throws,
+    // the in-memory view is unchanged; bytes written past the old size get
+    // overwritten by the next append or truncated on restart.
+    u::pwriteAll(fd, lines, length);
+    METRICS_TIME(fsync, KJ_SYSCALL(fdatasync(fd)));
+
+    auto oldEntries = entries.size();
+    auto oldStart = entries.back().offset;
+    auto oldLineCount = lineCount;
+    auto oldAtLineStart = atLineStart;
+    KJ_ON_SCOPE_FAILURE({
+      entries.truncate(oldEntries);
+      lineCount = oldLineCount;
+      atLineStart = oldAtLineStart;
+    });
+    scan(lines, length);
+    if (entries.size() > oldEntries) {
+      auto text = formatEntries(oldEntries);
+      kj::FdOutputStream(indexFd.get()).write(text.begin(), text.size());
+      METRICS_TIME(fsync, KJ_SYSCALL(fdatasync(indexFd)));
+    }
+    u::writeFileAtomic(CHATSIZE_PATH, kj::str(length + lines.size()));
+
+    length += lines.size();
+    extendTail(lines, oldStart);
+  }
+
+ private:
+  struct Entry {
+    uint64_t line;
+    uint64_t offset;
+  };
+
+  bool loadIndex() {
+    // Reads index entries that lie within the transcript. Returns false if
+    // the index needs rewriting: it's missing, torn, or runs past .chatsize.
+    if (access(CHATINDEX_PATH, F_OK) == -1) {
+      if (errno != ENOENT) {
+        KJ_FAIL_SYSCALL("access", errno);
+      }
+      return false;
+    }
+    auto text = u::readFile(CHATINDEX_PATH);
+    kj::StringPtr rest = text;
+    while (rest.size() > 0) {
+      KJ_IF_MAYBE(nlPos, rest.findFirst('\n')) {
+        auto entry = kj::heapString(rest.slice(0, *nlPos));
+        rest = rest.slice(*nlPos + 1);
+        KJ_IF_MAYBE(spPos, entry.findFirst(' ')) {
+          auto line = u::tryParseUint(kj::heapString(entry.slice(0, *spPos)));
+          auto offset = u::tryParseUint(entry.slice(*spPos + 1));
+          KJ_IF_MAYBE(l, line) {
+            KJ_IF_MAYBE(o, offset) {
+              if (*o > entries.back().offset && *l >= entries.back().line && *o < length) {
+                entries.add(Entry{*l, *o});
+                continue;
+              }
+            }
+          }
+        }
+      }
+      return false;
+    }
+    return true;
+  }
+
+  void scan(kj::ArrayPtr<const char> data, uint64_t at) {
+    // Counts lines in data, which sits at offset `at`, starting a new segment
+    // at the first line start at least SEGMENT_SIZE past the current one.
+    for (size_t i = 0; i < data.size(); ++i) {
+      if (atLineStart && at + i >= entries.back().offset + SEGMENT_SIZE) {
+        entries.add(Entry{lineCount, at + i});
+      }
+      atLineStart = data[i] == '\n';
+      if (atLineStart)
+        ++lineCount;
+    }
+  }
+
+  void extendTail(kj::ArrayPtr<const char> data, uint64_t oldStart) {
+    // Appends data to the resident tail, dropping everything before the last
+    // segment start.
+    tail.addAll(data);
+    auto start = entries.back().offset;
+    if (start != oldStart) {
+      kj::Vector<char> newTail(SEGMENT_SIZE);
+      newTail.addAll(tail.begin() + (start - oldStart), tail.end());
+      tail = kj::mv(newTail);
+    }
+  }
+
+  kj::String formatEntries(size_t from) const {
+    kj::Vector<kj::String> ret;
+    for (auto& entry: entries.asPtr().slice(from, entries.size())) {
+      ret.add(kj::str(entry.line, ' ', entry.offset, '\n'));
+    }
+    return kj::strArray(ret, "");
+  }
+
+  uint64_t length;
+  kj::AutoCloseFd fd;
+  kj::AutoCloseFd indexFd;
+  kj::Vector<Entry> entries;
+  kj::Vector<char> tail;
+  uint64_t lineCount;
+  bool atLineStart = true;
+};
+
+class SearchSegment {
+  // The search postings for one closed transcript segment, in an immutable
+  // file at SEARCH_PATH.<segment start> that's mapped rather than read:
+  //
+  //   header     Header below
+  //   summary    for every stride-th word, the word and where its block starts
+  //   blocks     the words in sorted order, stride to a block, each followed
+  //              by the offsets of the lines containing it
+  //
+  // Past the header, a word is a varint length and its bytes, and a word's
+  // offsets are a varint byte count, then varints each relative to the one
+  // before (the first to the segment start). Only the summary is copied into
+  // memory; a lookup finds its block there and scans just that.
+ public:
+  using Postings = std::unordered_map<kj::String, kj::Vector<uint64_t>, u::StringHash>;
+
+  explicit SearchSegment(kj::Array<const char>&& data): data(kj::mv(data)) {}
+
+  static kj::Maybe<kj::Own<SearchSegment>> open(uint64_t start, uint64_t end) {
+    // Null if the file is missing or doesn't describe [start, end).
+    auto name = path(start);
+    if (access(name.cStr(), F_OK) == -1) {
+      if (errno != ENOENT) {
+        KJ_FAIL_SYSCALL("access", errno, name);
+      }
+      return nullptr;
+    }
+    auto fd = u::raiiOpen(name, O_RDONLY);
+    auto segment = kj::heap<SearchSegment>(u::mapFile(fd, 0, u::getFileSize(name)));
+    if (!segment->check(start, end))
+      return nullptr;
+    return kj::mv(segment);
+  }
+
+  static void write(uint64_t start, uint64_t end, const Postings& postings) {
+    // Writes the postings in [start, end) out as the file for that segment.
+    // postings mustn't have anything before start.
+    kj::Vector<std::pair<kj::StringPtr, kj::ArrayPtr<const uint64_t>>> lists;
+    for (auto& entry: postings) {
+      auto& list = entry.second;
+      auto count = std::lower_bound(list.begin(), list.end(), end) - list.begin();
+      if (count > 0)
+        lists.add(entry.first, list.asPtr().slice(0, count));
+    }
+    std::sort(lists.begin(), lists.end(), [](auto& a, auto& b) {
+      return less(a.first, b.first);
+    });
+
+    kj::Vector<char> summary;
+    kj::Vector<char> blocks;
+    kj::Vector<char> encoded;
+    for (size_t i = 0; i < lists.size(); ++i) {
+      if (i % DICT_STRIDE == 0) {
+        addWord(summary, lists[i].first);
+        addVarint(summary, blocks.size());
+      }
+      addWord(blocks, lists[i].first);
+      encoded.resize(0);
+      auto last = start;
+      for (auto offset: lists[i].second) {
+        addVarint(encoded, offset - last);
+        last = offset;
+      }
+      addVarint(blocks, encoded.size());
+      blocks.addAll(encoded);
+    }
+
+    Header header = {{'c', 's', 'x', '1'}, uint32_t(lists.size()), start, end,
+                     uint32_t(summary.size()), DICT_STRIDE};
+    KJ_REQUIRE(summary.size() <= UINT32_MAX);
+    auto content = kj::heapString(sizeof(header) + summary.size() + blocks.size());
+    memcpy(content.begin(), &header, sizeof(header));
+    memcpy(content.begin() + sizeof(header), summary.begin(), summary.size());
+    memcpy(content.begin() + sizeof(header) + summary.size(), blocks.begin(), blocks.size());
+    u::writeFileAtomic(path(start), content);
+  }
+
+  static kj::String path(uint64_t start) {
+    return kj::str(SEARCH_PATH, '.', start);
+  }
+
+  uint64_t start() const {
+    return header.start;
+  }
+
+  kj::Vector<uint64_t> find(kj::StringPtr word) const {
+    // Offsets of the lines containing word, ascending; empty if there are
+    // none.
+    kj::Vector<uint64_t> ret;
+    auto iter = std::upper_bound(summary.begin(), summary.end(), word, [](auto& a, auto& b) {
+      return less(a, b.word);
+    });
+    if (iter == summary.begin())
+      return ret;
+    --iter;
+    auto pos = iter->block;
+    auto blockEnd = iter + 1 == summary.end() ? blocks.size() : (iter + 1)->block;
+    while (pos < blockEnd) {
+      auto entry = readWord(blocks, pos);
+      auto size = readVarint(blocks, pos);
+      KJ_REQUIRE(size <= blocks.size() - pos, "corrupt search segment");
+      if (entry == word.asArray()) {
+        auto encoded = blocks.slice(pos, pos + size);
+        auto last = header.start;
+        for (size_t i = 0; i < encoded.size();) {
+          last += readVarint(encoded, i);
+          ret.add(last);
+        }
+        break;
+      }
+      if (less(word, entry))
+        break;
+      pos += size;
+    }
+    return ret;
+  }
+
+ private:
+  static constexpr uint32_t DICT_STRIDE = 64;
+
+  struct Header {
+    char magic[4];
+    uint32_t words;
+    uint64_t start;
+    uint64_t end;
+    uint32_t summaryBytes;
+    uint32_t stride;
+  };
+
+  struct Block {
+    kj::String word;   // its first
+    size_t block;      // offset into blocks
+  };
+
+  static bool less(kj::ArrayPtr<const char> a, kj::ArrayPtr<const char> b) {
+    auto cmp = memcmp(a.begin(), b.begin(), kj::min(a.size(), b.size()));
+    return cmp < 0 || (cmp == 0 && a.size() < b.size());
+  }
+
+  static void addVarint(kj::Vector<char>& out, uint64_t value) {
+    while (value >= 0x80) {
+      out.add(char(value | 0x80));
+      value >>= 7;
+    }
+    out.add(char(value));
+  }
+
+  static void addWord(kj::Vector<char>& out, kj::StringPtr word) {
+    addVarint(out, word.size());
+    out.addAll(word);
+  }
+
+  static uint64_t readVarint(kj::ArrayPtr<const char> in, size_t& pos) {
+    uint64_t value = 0;
+    for (unsigned shift = 0;; shift += 7) {
+      KJ_REQUIRE(pos < in.size() && shift < 64, "corrupt search segment");
+      auto b = static_cast<unsigned char>(in[pos++]);
+      value |= uint64_t(b & 0x7f) << shift;
+      if (b < 0x80)
+        return value;
+    }
+  }
+
+  static kj::ArrayPtr<const char> readWord(kj::ArrayPtr<const char> in, size_t& pos) {
+    auto size = readVarint(in, pos);
+    KJ_REQUIRE(size <= in.size() - pos, "corrupt search segment");
+    pos += size;
+    return in.slice(pos - size, pos);
+  }
+
+  bool check(uint64_t start, uint64_t end) {
+    // Reads the header and summary. Blocks are bounds-checked as they're
+    // scanned.
+    if (data.size() < sizeof(header))
+      return false;
+    // Lookups touch a block here and there; don't read the rest in with them.
+    KJ_SYSCALL(madvise(const_cast<char*>(data.begin()), data.size(), MADV_RANDOM));
+    memcpy(&header, data.begin(), sizeof(header));
+    if (memcmp(header.magic, "csx1", 4) != 0 || header.start != start || header.end != end ||
+        header.stride == 0 || header.summaryBytes > data.size() - sizeof(header))
+      return false;
+    auto text = data.slice(sizeof(header), sizeof(header) + header.summaryBytes);
+    blocks = data.slice(sizeof(header) + header.summaryBytes, data.size());
+
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      for (size_t pos = 0; pos < text.size();) {
+        auto word = readWord(text, pos);
+        auto block = readVarint(text, pos);
+        KJ_REQUIRE(block < blocks.size() && (summary.size() == 0 || block > summary.back().block));
+        summary.add(Block{kj::heapString(word), block});
+      }
+    })) {
+      return false;
+    }
+    return summary.size() == (uint64_t(header.words) + header.stride - 1) / header.stride;
+  }
+
+  kj::Array<const char> data;
+  Header header;
+  kj::ArrayPtr<const char> blocks;
+  kj::Vector<Block> summary;
+};
+
+class SearchIndex {
+  // Inverted index over the transcript. A word is a run of ASCII letters and
+  // digits or non-ASCII bytes, lowercased and cut at MAX_WORD_SIZE; each maps
+  // to the offsets of the lines containing it, ascending. Each closed
+  // transcript segment gets a SearchSegment when it closes; only postings for
+  // the open segment are held in memory, and on startup that's all we
+  // tokenize, along with any closed segment whose file is missing or stale.
+ public:
+  SearchIndex(const Transcript& transcript): transcript(transcript) {
+    auto closed = transcript.segmentCount() - 1;
+    while (sealed < closed) {
+      auto start = transcript.segmentStart(sealed);
+      auto end = transcript.segmentStart(sealed + 1);
+      KJ_IF_MAYBE(segment, SearchSegment::open(start, end)) {
+        segments.add(kj::mv(*segment));
+        ++sealed;
+        indexed = lineStart = end;
+        continue;
+      }
+      KJ_LOG(INFO, "indexing chats for search", start, end);
+      tokenize(transcript.read(start, end), start);
+      indexed = end;
+      if (!seal())
+        break;
+    }
+
+    auto length = transcript.size();
+    for (auto at = indexed; at < length; at += SEGMENT_SIZE) {
+      tokenize(transcript.read(at, kj::min(length, at + SEGMENT_SIZE)), at);
+    }
+    finish();
+    indexed = length;
+    seal();
+    removeStale();
+  }
+
+  void add(kj::ArrayPtr<const char> lines, uint64_t at) {
+    // Indexes lines just committed at transcript offset `at`, writing out the
+    // segment they closed, if any.
+    KJ_REQUIRE(at == indexed);
+    tokenize(lines, at);
+    finish();
+    indexed = at + lines.size();
+    seal();
+  }
+
+  kj::Vector<uint64_t> find(kj::StringPtr query, size_t limit) const {
+    // Returns the offsets of the last `limit` lines containing every word in
+    // query, oldest first. Segments are searched newest first, so a common
+    // query stops after the last one or two.
+    kj::Vector<kj::String> words;
+    kj::Vector<char> word;
+    for (size_t i = 0; i <= query.size(); ++i) {
+      if (i < query.size() && isWordByte(query[i])) {
+        if (word.size() < MAX_WORD_SIZE)
+          word.add(lower(query[i]));
+      } else if (word.size() > 0) {
+        words.add(kj::heapString(word.begin(), word.size()));
+        word.clear();
+      }
+    }
+    kj::Vector<uint64_t> ret;
+    if (words.size() == 0)
+      return ret;
+
+    kj::Vector<kj::ArrayPtr<const uint64_t>> lists;
+    for (auto& w: words) {
+      auto iter = tail.find(w);
+      if (iter == tail.end())
+        break;
+      lists.add(iter->second.asPtr());
+    }
+    if (lists.size() == words.size())
+      matchNewest(lists, limit, ret);
+
+    for (auto i = segments.size(); i-- > 0 && ret.size() < limit;) {
+      kj::Vector<kj::Vector<uint64_t>> decoded;
+      lists.resize(0);
+      for (auto& w: words) {
+        auto list = segments[i]->find(w);
+        if (list.size() == 0)
+          break;
+        decoded.add(kj::mv(list));
+        lists.add(decoded.back().asPtr());
+      }
+      if (lists.size() == words.size())
+        matchNewest(lists, limit, ret);
+    }
+    std::reverse(ret.begin(), ret.end());
+    return ret;
+  }
+
+ private:
+  static bool isWordByte(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           static_cast<unsigned char>(c) >= 0x80;
+  }
+
+  static char lower(char c) {
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+  }
+
+  static void matchNewest(kj::ArrayPtr<const kj::ArrayPtr<const uint64_t>> lists, size_t limit,
+                          kj::Vector<uint64_t>& ret) {
+    // Adds offsets in every list to ret, newest first, until it has `limit`.
+    auto shortest = *std::min_element(lists.begin(), lists.end(), [](auto a, auto b) {
+      return a.size() < b.size();
+    });
+    for (auto iter = shortest.end(); iter != shortest.begin() && ret.size() < limit;) {
+      auto offset = *--iter;
+      bool all = true;
+      for (auto list: lists) {
+        all = all && std::binary_search(list.begin(), list.end(), offset);
+      }
+      if (all)
+        ret.add(offset);
+    }
+  }
+
+  void tokenize(kj::ArrayPtr<const char> data, uint64_t at) {
+    // Indexes data, which sits at transcript offset `at`. A word may carry on
+    // into the next call; finish() ends it.
+    for (size_t i = 0; i < data.size(); ++i) {
+      auto c = data[i];
+      if (isWordByte(c)) {
+        if (word.size() < MAX_WORD_SIZE)
+          word.add(lower(c));
+        continue;
+      }
+      finish();
+      if (c == '\n')
+        lineStart = at + i + 1;
+    }
+  }
+
+  void finish() {
+    if (word.size() == 0)
+      return;
+    auto key = kj::heapString(word.begin(), word.size());
+    word.clear();
+    auto iter = tail.find(key);
+    if (iter == tail.end())
+      iter = tail.emplace(kj::mv(key), kj::Vector<uint64_t>()).first;
+    auto& list = iter->second;
+    if (list.size() == 0 || list.back() != lineStart)
+      list.add(lineStart);
+  }
+
+  bool seal() {
+    // Writes out each closed segment we've tokenized all of and drops its
+    // postings from memory. If a write fails they stay in memory, and we
+    // try again after the next commit.
+    while (sealed + 1 < transcript.segmentCount() &&
+           transcript.segmentStart(sealed + 1) <= indexed) {
+      auto start = transcript.segmentStart(sealed);
+      auto end = transcript.segmentStart(sealed + 1);
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+        SearchSegment::write(start, end, tail);
+        auto segment = SearchSegment::open(start, end);
+        KJ_IF_MAYBE(s, segment) {
+          segments.add(kj::mv(*s));
+        } else {
+          KJ_FAIL_ASSERT("search segment didn't read back", start);
+        }
+      })) {
+        KJ_LOG(ERROR, "couldn't write search segment", start, *exception);
+        return false;
+      }
+      ++sealed;
+
+      for (auto iter = tail.begin(); iter != tail.end();) {
+        auto& list = iter->second;
+        auto keep = std::lower_bound(list.begin(), list.end(), end);
+        if (keep == list.end()) {
+          iter = tail.erase(iter);
+          continue;
+        }
+        if (keep != list.begin()) {
+          kj::Vector<uint64_t> rest(list.end() - keep);
+          rest.addAll(keep, list.end());
+          list = kj::mv(rest);
+        }
+        ++iter;
+      }
+    }
+    return true;
+  }
+
+  void removeStale() {
+    // Deletes segment files that don't match a closed segment any more, say
+    // after .chatsize was rolled back.
+    auto dirname = u::dirName(SEARCH_PATH);
+    auto prefix = kj::str(kj::StringPtr(SEARCH_PATH).slice(dirname.size() + 1), '.');
+    DIR* dir = opendir(dirname.cStr());
+    if (dir == nullptr)
+      KJ_FAIL_SYSCALL("opendir", errno, dirname);
+    KJ_DEFER(closedir(dir));
+    while (auto entry = readdir(dir)) {
+      kj::StringPtr name = entry->d_name;
+      if (!name.startsWith(prefix))
+        continue;
+      KJ_IF_MAYBE(start, u::tryParseUint(name.slice(prefix.size()))) {
+        auto iter = std::lower_bound(segments.begin(), segments.end(), *start,
+                                     [](auto& s, uint64_t v) { return s->start() < v; });
+        if (iter != segments.end() && (*iter)->start() == *start)
+          continue;
+      }
+      KJ_SYSCALL(unlink(kj::str(dirname, '/', name).cStr()), name);
+    }
+  }
+
+  const Transcript& transcript;
+  kj::Vector<kj::Own<SearchSegment>> segments;   // one per sealed segment
+  size_t sealed = 0;
+  SearchSegment::Postings tail;   // for transcript bytes past segments
+  uint64_t indexed = 0;
+  uint64_t lineStart = 0;
+  kj::Vector<char> word;
+};
+
+class DiskStream: public ChatStream, private kj::TaskSet::ErrorHandler {
+ public:
+  DiskStream(kj::Timer& timer):
+      ChatStream(timer, 0, [this]() { fullCache.invalidate(); }),
+      searchIndex(transcript),
+      timer(timer),
+      tasks(*this) {
+    length = transcript.size();
+  }
+
+  kj::Own<u::Snapshot> get() {
+    // A full body is the whole transcript, so it's only shared while a write
+    // is waking parked requests, which would otherwise each read it again.
+    // The cache is dropped once they're done (see the constructor) rather
+    // than pinning the transcript in memory for a quiet room.
+    if (!waking())
+      return kj::refcounted<u::Snapshot>(transcript.read(0));
+    return fullCache.get([this]() {
+      return transcript.read(0);
+    });
+  }
+
+  kj::Own<u::Snapshot> getSince(uint64_t offset) {
+    // Deltas starting in the resident segment are cheap to hold and are what
+    // parked long-polls all want. Older ones are built per request.
+    if (offset < transcript.residentFrom())
+      return kj::refcounted<u::Snapshot>(transcript.read(offset));
+    return deltaCache.get([this, offset]() {
+      return transcript.read(offset);
+    }, offset);
+  }
+
+  kj::String search(kj::StringPtr query) const {
+    // "<offset> <line>" for each of the last MAX_SEARCH_RESULTS lines
+    // matching every word in query.
+    kj::Vector<kj::String> ret;
+    for (auto offset: searchIndex.find(query, MAX_SEARCH_RESULTS)) {
+      ret.add(kj::str(offset, ' ', transcript.readLine(offset), '\n'));
+    }
+    return kj::strArray(ret, "");
+  }
+
+  kj::Promise<void> write(kj::StringPtr line) {
+    // Lines written within COMMIT_WINDOW of each other are committed as one
+    // batch. The returned promise resolves once this line's batch is durable;
+    // readers don't see the line until then either.
+    METRICS_DO(++u::metrics().messagesWritten);
+    if (pendingDone.get() == nullptr) {
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      pendingDone = kj::mv(paf.fulfiller);
+      pendingDurable = paf.promise.fork();
+      tasks.add(timer.afterDelay(COMMIT_WINDOW).then([this]() {
+        commit();
+      }));
+    }
+    pending.addAll(line);
+    return pendingDurable.addBranch();
+  }
+
+ private:
+  void commit() {
+    // If anything here throws, the batch's waiters are dropped along with
+    // it, so their writes fail rather than hang.
+    auto batch = kj::mv(pending);
+    auto done = kj::mv(pendingDone);
+
+    auto at = transcript.size();
+    METRICS_TIME(commit, transcript.append(batch));
+    METRICS_DO(++u::metrics().batchesCommitted);
+    published(batch.size());
+    done->fulfill();
+    searchIndex.add(batch, at);
+  }
+
+  void taskFailed(kj::Exception&& exception) override {
+    KJ_LOG(ERROR, "chat commit failed", exception);
+  }
+
+  Transcript transcript;
+  SearchIndex searchIndex;
+  kj::Timer& timer;
+  kj::Vector<char> pending;
+  kj::Own<kj::PromiseFulfiller<void>> pendingDone;
+  kj::ForkedPromise<void> pendingDurable = nullptr;
+  kj::TaskSet tasks;
+};
+
+
+class Topic {
+ public:
+  Topic(kj::Timer& timer):
+      topic(kj::refcounted<u::Snapshot>(kj::heapString("Random chatter"))),
+      topicQueue(timer) {}
+  Topic(kj::Timer& timer, kj::String&& topic):
+      topic(kj::refcounted<u::Snapshot>(kj::mv(topic))),
+      topicQueue(timer) {}
+
+  kj::Own<u::Snapshot> get() {
+    return kj::addRef(*topic);
+  }
+
+  kj::Promise<void> onNew() {
+    return topicQueue.wait();
+  }
+
+  size_t waiters() const {
+    return topicQueue.size();
+  }
+
+  void set(kj::StringPtr topic_) {
+    topic = kj::refcounted<u::Snapshot>(kj::heapString(topic_));
+    topicQueue.ready();
+  }
+
+ private:
+  kj::Own<u::Snapshot> topic;
+  u::WaitQueue topicQueue;
+};
+
+class DiskTopic: public Topic {
+ public:
+  DiskTopic(kj::Timer& timer): Topic(timer, u::readFile(TOPIC_PATH)) {}
+  void set(kj::StringPtr topic_) {
+    u::writeFileAtomic(TOPIC_PATH, topic_);
+    Topic::set(topic_);
+  }
+};
+
+
+class StaticIndex {
+ public:
+  StaticIndex(): index(u::readFile(INDEX_PATH)) {}
+
+  kj::StringPtr get() const {
+    return index;
+  }
+
+ private:
+  const kj::String index;
+};
+
+
+class UserList {
+  // Who's here. All sessions of one identity share an entry, and so a
+  // handle; an entry counts the sessions behind it. Every change bumps the
+  // version and goes in a log of the last MAX_USER_CHANGES, so a client can
+  // ask for what changed since the version it saw rather than the whole list.
+ public:
+  class Presence {
+    // One session's membership, for as long as it's alive.
+   public:
+    Presence(UserList& users, sandstorm::UserInfo::Reader userInfo):
+        users(users),
+        identity(userInfo.hasIdentityId()
+                 ? u::showAsHex(userInfo.getIdentityId())
+                 : kj::str("session-", users.nextAnonymous++)),
+        handle(users.join(identity, userInfo)) {}
+    KJ_DISALLOW_COPY(Presence);
+
+    ~Presence() noexcept(false) {
+      users.leave(identity);
+    }
+
+    kj::StringPtr getHandle() const {
+      return handle;
+    }
+
+   private:
+    UserList& users;
+    const kj::String identity;
+    const kj::StringPtr handle;   // owned by users.byHandle
+  };
+
+  UserList(kj::Timer& timer): epoch(u::randomEpoch()), usersQueue(timer) {}
+
+  kj::Own<u::Snapshot> get() {
+    // Just the handles, one per line.
+    return listCache.get([this]() {
+      return sortedLines([](const HandleMap::value_type& entry) {
+        return kj::str(entry.first, '\n');
+      });
+    });
+  }
+
+  kj::Maybe<Update> since(kj::StringPtr cursor) {
+    // Like updateSince() for chats: null if cursor is current, else a "delta" of the
+    // changes past it or, if those have left the log, a "full" list. Lines
+    // are "+<handle> <sessions>" for a join or a new session count, and
+    // "-<handle>" for a departure; a full list is all joins.
+    KJ_IF_MAYBE(from, versionFor(cursor)) {
+      if (*from == version)
+        return nullptr;
+      return Update{"delta", this->cursor(), deltaCache.get([this, from]() {
+        return changesSince(*from);
+      }, *from)};
+    }
+    return Update{"full", this->cursor(), fullCache.get([this]() {
+      return sortedLines([](const HandleMap::value_type& entry) {
+        return kj::str('+', entry.first, ' ', entry.second.sessions, '\n');
+      });
+    })};
+  }
+
+  kj::Promise<void> onNew() {
+    return usersQueue.wait();
+  }
+
+  size_t waiters() const {
+    return usersQueue.size();
+  }
+
+ private:
+  struct Entry {
+    kj::String base;    // the preferred handle this one was made from
+    uint64_t sessions;
+  };
+  using HandleMap = std::unordered_map<kj::String, Entry, u::StringHash>;
+
+  struct Member {
+    HandleMap::value_type* entry;   // elements stay put across rehashes
+    uint64_t sessions;
+  };
+
+  struct Base {
+    uint64_t nextSuffix;
+    uint64_t handles;   // live handles made from this base
+  };
+
+  struct Change {
+    uint64_t version;
+    kj::String handle;
+    uint64_t sessions;   // 0 if they left
+  };
+
+  kj::StringPtr join(kj::String const& identity, sandstorm::UserInfo::Reader userInfo) {
+    auto member = byIdentity.find(identity);
+    if (member != byIdentity.end()) {
+      auto entry = member->second.entry;
+      ++member->second.sessions;
+      changed(entry->first, ++entry->second.sessions);
+      return entry->first;
+    }
+
+    kj::String base;
+    if (userInfo.hasPreferredHandle()) {
+      base = u::filteredString(
+          [](char x){ return x != ' ' && x != '\n' && x != ':'; },
+          userInfo.getPreferredHandle());
+    } else {
+      base = kj::heapString("anon");
+    }
+#if !UNIQUE_HANDLES
+    auto iter = byHandle.find(base);
+    if (iter == byHandle.end()) {
+      auto handle = kj::heapString(base);
+      iter = byHandle.emplace(kj::mv(handle), Entry{kj::mv(base), 0}).first;
+    }
+#else
+    // Each base hands out suffixes in order, so this is one probe unless
+    // someone's preferred handle happens to look like base plus a number.
+    auto baseIter = bases.find(base);
+    if (baseIter == bases.end())
+      baseIter = bases.emplace(kj::heapString(base), Base{1, 0}).first;
+    auto handle = kj::heapString(base);
+    while (byHandle.find(handle) != byHandle.end()) {
+      handle = kj::str(base, baseIter->second.nextSuffix++);
+    }
+    ++baseIter->second.handles;
+    auto iter = byHandle.emplace(kj::mv(handle), Entry{kj::mv(base), 0}).first;
+#endif  // UNIQUE_HANDLES
+    byIdentity.emplace(kj::heapString(identity), Member{&*iter, 1});
+    changed(iter->first, ++iter->second.sessions);
+    return iter->first;
+  }
+
+  void leave(kj::String const& identity) {
+    auto member = byIdentity.find(identity);
+    KJ_ASSERT(member != byIdentity.end());
+    auto entry = member->second.entry;
+    auto sessions = --entry->second.sessions;
+    if (--member->second.sessions == 0)
+      byIdentity.erase(member);
+    changed(entry->first, sessions);
+    if (sessions == 0) {
+#if UNIQUE_HANDLES
+      auto base = bases.find(entry->second.base);
+      if (--base->second.handles == 0)
+        bases.erase(base);
+#endif
+      byHandle.erase(byHandle.find(entry->first));
+    }
+  }
+
+  void changed(kj::StringPtr handle, uint64_t sessions) {
+    ++version;
+    changes.push_back(Change{version, kj::heapString(handle), sessions});
+    if (changes.size() > MAX_USER_CHANGES)
+      changes.pop_front();
+    listCache.invalidate();
+    fullCache.invalidate();
+    deltaCache.invalidate();
+    usersQueue.ready();
+  }
+
+  kj::String cursor() const {
+    // Same shape as ChatStream::cursor(): the epoch keeps versions from
+    // before a restart from meaning anything now.
+    return kj::str(epoch, '.', version);
+  }
+
+  kj::Maybe<uint64_t> versionFor(kj::StringPtr cursor) const {
+    // The version a cursor refers to, if we can still diff against it.
+    KJ_IF_MAYBE(dotPos, cursor.findFirst('.')) {
+      KJ_IF_MAYBE(e, u::tryParseUint(kj::heapString(cursor.slice(0, *dotPos)))) {
+        KJ_IF_MAYBE(v, u::tryParseUint(cursor.slice(*dotPos + 1))) {
+          auto oldest = changes.empty() ? version : changes.front().version - 1;
+          if (*e == epoch && *v >= oldest && *v <= version)
+            return *v;
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  kj::String changesSince(uint64_t from) const {
+    // Only the latest change to each handle matters.
+    std::unordered_set<kj::StringPtr, u::StringHash> seen;
+    kj::Vector<kj::String> lines;
+    for (auto iter = changes.rbegin(); iter != changes.rend() && iter->version > from; ++iter) {
+      if (!seen.insert(iter->handle).second)
+        continue;
+      if (iter->sessions == 0) {
+        lines.add(kj::str('-', iter->handle, '\n'));
+      } else {
+        lines.add(kj::str('+', iter->handle, ' ', iter->sessions, '\n'));
+      }
+    }
+    std::reverse(lines.begin(), lines.end());
+    return kj::strArray(lines, "");
+  }
+
+  template <typename Func>
+  kj::String sortedLines(Func&& format) const {
+    // One line per handle, in handle order.
+    kj::Vector<kj::String> lines(byHandle.size());
+    for (auto& entry: byHandle) {
+      lines.add(format(entry));
+    }
+    std::sort(lines.begin(), lines.end());
+    return kj::strArray(lines, "");
+  }
+
+  HandleMap byHandle;
+  std::unordered_map<kj::String, Member, u::StringHash> byIdentity;
+#if UNIQUE_HANDLES
+  std::unordered_map<kj::String, Base, u::StringHash> bases;
+#endif
+  uint64_t nextAnonymous = 0;
+
+  const uint64_t epoch;
+  uint64_t version = 0;
+  std::deque<Change> changes;
+  u::SnapshotCache listCache;
+  u::SnapshotCache fullCache;
+  u::SnapshotCache deltaCache;
+  u::WaitQueue usersQueue;
+};
+
+
+template <typename ChatStreamT, typename TopicT>
+struct AppState {
+ public:
+  AppState(kj::Timer& timer):
+      timer(timer),
+      chats(timer),
+      topic(timer),
+      users(timer),
+      polls(timer, LONG_POLL_TIMEOUT, MAX_POLLS_PER_SESSION, MAX_POLLS) {}
+
+  kj::Timer& timer;
+  const StaticIndex index;
+  ChatStreamT chats;
+  TopicT topic;
+  UserList users;
+  u::LongPolls polls;
+};
+
+using MemState = AppState<MemStream, Topic>;
+using DiskState = AppState<DiskStream, DiskTopic>;
+
+
+template <typename Context, typename T>
+kj::Promise<void> respondWithObject(Context context, T& object, bool awaitNew,
+                                    u::LongPolls::Session& polls) {
+  if (awaitNew) {
+    if (!polls.canPark())
+      return u::respondWithOverloaded(context);
+    return polls.park(object.onNew()).then(
+        [context, &object](bool changed) mutable {
+          if (!changed)
+            return u::respondWithNoContent(context);
+          return u::respondWith(context, object.get()->body, "text/plain");
+        });
+  }
+  return u::respondWith(context, object.get()->body, "text/plain");
+}
+
+template <typename ChatStreamT>
+kj::Maybe<Update> updateSince(ChatStreamT& chats, kj::StringPtr cursor) {
+  // Returns whatever a client holding cursor is missing: either the lines
+  // past it or, if the cursor is stale, the whole transcript. Null if the
+  // cursor is already current.
+  KJ_IF_MAYBE(offset, chats.offsetFor(cursor)) {
+    if (*offset == chats.size())
+      return nullptr;
+    return Update{"delta", chats.cursor(), chats.getSince(*offset)};
+  }
+  return Update{"full", chats.cursor(), chats.get()};
+}
+
+inline kj::Maybe<Update> updateSince(UserList& users, kj::StringPtr cursor) {
+  return users.since(cursor);
+}
+
+template <typename Context, typename T>
+kj::Promise<void> respondWithSince(Context context, T& object, kj::String cursor,
+                                   u::LongPolls::Session& polls) {
+  // Body is a header line ("full <cursor>" or "delta <cursor>") followed by
+  // the text from updateSince(). Parks if the cursor is current.
+  KJ_IF_MAYBE(update, updateSince(object, cursor)) {
+    return u::respondWithPrefixed(
+        context, kj::str(update->kind, ' ', update->cursor, '\n'), update->body->body,
+        "text/plain");
+  }
+  if (!polls.canPark())
+    return u::respondWithOverloaded(context);
+  return polls.park(object.onNew()).then(
+      [context, &object, cursor = kj::mv(cursor), &polls](bool changed) mutable {
+        if (!changed)
+          return u::respondWithNoContent(context);
+        return respondWithSince(context, object, kj::mv(cursor), polls);
+      });
+}
+
+template <typename AppState>
+kj::Promise<void> postChat(AppState* appState, kj::StringPtr handle,
+                           kj::ArrayPtr<const char> content) {
+  auto chat = u::filteredString([](char x){ return x != '\n'; }, content);
+  return appState->chats.write(kj::str(handle, ": ", chat, "\n"));
+}
+
+template <typename AppState>
+kj::Promise<void> setTopic(AppState* appState, kj::StringPtr handle,
+                           kj::ArrayPtr<const char> content) {
+  auto topic = u::filteredString([](char x){ return x != '\n'; }, content);
+  appState->topic.set(topic);
+  return appState->chats.write(kj::str(handle, " set the topic to: ", topic, "\n"));
+}
+
+#if METRICS
+template <typename Context, typename AppState>
+kj::Promise<void> respondWithMetrics(Context context, AppState* appState) {
+  // u::metrics() plus gauges read off the app state. Latencies are
+  // histograms; see u::Histogram.
+  auto& metrics = u::metrics();
+  kj::Vector<kj::String> routes;
+  for (auto& entry: metrics.responseBytes) {
+    routes.add(kj::str('"', entry.first, "\": ", entry.second));
+  }
+  auto body = kj::str(
+      "{\"startup_us\": ", metrics.startupNs / 1000, ",\n"
+      " \"transcript_bytes\": ", appState->chats.size(), ",\n"
+      " \"messages_written\": ", metrics.messagesWritten, ",\n"
+      " \"bytes_written\": ", metrics.bytesWritten, ",\n"
+      " \"batches_committed\": ", metrics.batchesCommitted, ",\n"
+      " \"waiters\": {\"chats\": ", appState->chats.waiters(),
+      ", \"users\": ", appState->users.waiters(),
+      ", \"topic\": ", appState->topic.waiters(),
+      ", \"long_polls\": ", appState->polls.size(), "},\n"
+      " \"response_bytes\": {", kj::strArray(routes, ", "), "},\n"
+      " \"fsync\": ", metrics.fsync.toJson(), ",\n"
+      " \"rename\": ", metrics.rename.toJson(), ",\n"
+      " \"commit\": ", metrics.commit.toJson(), ",\n"
+      " \"wake\": ", metrics.wake.toJson(), ",\n"
+      " \"respond\": ", metrics.respond.toJson(), "}\n");
+  return u::respondWith(context, body, "application/json");
+}
+#endif  // METRICS
+
+template <typename GetContext, typename PostContext, typename AppState>
+class AppRoute {
+ public:
+  kj::Promise<void> get(kj::String const& path, kj::StringPtr query, GetContext context,
+                        AppState* appState) {
+    if (path == "otr")
+      return u::respondWith(context, "{\"otr\": false}", "application/json");
+    if (path == "search" && query.startsWith("q=")) {
+      auto value = query.slice(2);
+      size_t end = value.findFirst('&').orDefault(value.size());
+      auto words = u::decodeQueryValue(value.slice(0, end));
+      return u::respondWith(context, appState->chats.search(words), "text/plain");
+    }
+#if METRICS
+    if (path == "metrics")
+      return respondWithMetrics(context, appState);
+#endif
+    return u::respondWithNotFound(context);
+  }
+
+  kj::Promise<void> post(kj::String const& path, PostContext context,
+                         AppState* appState) {
+    return u::respondWithNotFound(context);
+  }
+};
+
+template <typename GetContext, typename PostContext>
+class AppRoute<GetContext, PostContext, MemState> {
+ public:
+  kj::Promise<void> get(kj::String const& path, kj::StringPtr query, GetContext context,
+                        MemState* appState) {
+    if (path == "otr")
+      return u::respondWith(context, "{\"otr\": true}", "application/json");
+#if METRICS
+    if (path == "metrics")
+      return respondWithMetrics(context, appState);
+#endif
+    return u::respondWithNotFound(context);
+  }
+
+  kj::Promise<void> post(kj::String const& path, PostContext context,
+                         MemState* appState) {
+    if (path == "reset") {
+      appState->chats.reset();
+      return u::respondWithRedirect(context, "/");
+    }
+    return u::respondWithNotFound(context);
+  }
+};
+
+
+template <typename AppState>
+class EventSocket final: public sandstorm::WebSession::WebSocketStream::Server,
+                         private kj::TaskSet::ErrorHandler {
+  // One tab's push channel. Each text message is a header line followed by a
+  // body. We send "chats full|delta <cursor>" and "users full|delta <cursor>"
+  // (as for GET chats?since= and users?since=) and "topic" as they change,
+  // plus "ok <id>" once each incoming "chats <id>" or "topic <id>" message
+  // has been committed, or "error <id>" and a description if it couldn't
+  // be. If we can't keep the tab up to date we close the socket, so it falls
+  // back to long-polling. At most MAX_SOCKET_SENDS updates are in flight; a
+  // tab that falls behind gets one delta covering everything it missed once
+  // there's room again.
+ public:
+  EventSocket(AppState* appState, kj::StringPtr handle,
+              sandstorm::WebSession::WebSocketStream::Client clientStream):
+      appState(appState),
+      handle(kj::heapString(handle)),
+      clientStream(kj::mv(clientStream)),
+      reader(MAX_SOCKET_MESSAGE),
+      sendDone(appState->timer),
+      tasks(*this) {
+    tasks.add(sendSince("chats", appState->chats, kj::heapString("")));
+    tasks.add(sendSince("users", appState->users, kj::heapString("")));
+    tasks.add(sendObject("topic", appState->topic));
+  }
+
+  kj::Promise<void> sendBytes(SendBytesContext context) override {
+    reader.feed(context.getParams().getMessage());
+    for (;;) {
+      KJ_IF_MAYBE(message, reader.next()) {
+        receive(kj::mv(*message));
+      } else {
+        break;
+      }
+    }
+    return kj::READY_NOW;
+  }
+
+ private:
+  template <typename T>
+  kj::Promise<void> sendSince(kj::StringPtr kind, T& object, kj::String cursor) {
+    if (inFlight >= MAX_SOCKET_SENDS) {
+      // Whatever changes while we wait is folded into one delta from cursor,
+      // and if nothing did, we just go back to waiting for a change.
+      return sendDone.wait().then([this, kind, &object, cursor = kj::mv(cursor)]() mutable {
+        return sendSince(kind, object, kj::mv(cursor));
+      });
+    }
+    KJ_IF_MAYBE(update, updateSince(object, cursor)) {
+      send(kj::str(kind, ' ', update->kind, ' ', update->cursor, '\n'), update->body->body);
+      cursor = kj::mv(update->cursor);
+    }
+    return object.onNew().then([this, kind, &object, cursor = kj::mv(cursor)]() mutable {
+      return sendSince(kind, object, kj::mv(cursor));
+    });
+  }
+
+  template <typename T>
+  kj::Promise<void> sendObject(kj::StringPtr kind, T& object) {
+    if (inFlight >= MAX_SOCKET_SENDS) {
+      return sendDone.wait().then([this, kind, &object]() {
+        return sendObject(kind, object);
+      });
+    }
+    send(kj::str(kind, '\n'), object.get()->body);
+    return object.onNew().then([this, kind, &object]() {
+      return sendObject(kind, object);
+    });
+  }
+
+  void receive(u::WebSocketReader::Message&& message) {
+    switch (message.opcode) {
+      case u::WS_TEXT: {
+        // The payload isn't NUL-terminated, so it can't be a StringPtr.
+        auto text = message.payload.asChars();
+        auto nl = std::find(text.begin(), text.end(), '\n');
+        if (nl != text.end()) {
+          // The header is the kind, then optionally a space and an id the
+          // tab picked, which we echo back in the ack.
+          auto sp = std::find(text.begin(), nl, ' ');
+          auto kind = kj::heapString(text.begin(), sp - text.begin());
+          auto id = sp == nl ? kj::heapString("") : kj::heapString(sp + 1, nl - sp - 1);
+          auto body = text.slice(nl - text.begin() + 1, text.size());
+          if (kind == "chats") {
+            tasks.add(acknowledge(postChat(appState, handle, body), kj::mv(id)));
+          } else if (kind == "topic") {
+            tasks.add(acknowledge(setTopic(appState, handle, body), kj::mv(id)));
+          }
+        }
+        break;
+      }
+      case u::WS_PING:
+        send("", message.payload.asChars(), u::WS_PONG);
+        break;
+      case u::WS_CLOSE:
+        // Echo the status code, then go quiet.
+        send("", message.payload.asChars().slice(0, kj::min(message.payload.size(), 2)),
+             u::WS_CLOSE);
+        closed = true;
+        break;
+      default:
+        break;
+    }
+  }
+
+  void send(kj::StringPtr prefix, kj::ArrayPtr<const char> body, byte opcode = u::WS_TEXT) {
+    if (closed)
+      return;
+    byte header[10];
+    auto size = prefix.size() + body.size();
+    auto headerSize = u::webSocketHeader(header, opcode, size);
+    auto req = clientStream.sendBytesRequest();
+    auto bytes = req.initMessage(headerSize + size);
+    memcpy(bytes.begin(), header, headerSize);
+    memcpy(bytes.begin() + headerSize, prefix.begin(), prefix.size());
+    memcpy(bytes.begin() + headerSize + prefix.size(), body.begin(), body.size());
+    METRICS_DO(u::metrics().responded("events", headerSize + size));
+    // Control frames count against MAX_SOCKET_SENDS too, but only updates
+    // wait for room.
+    ++inFlight;
+    tasks.add(req.send().then([this](auto&&) {
+      --inFlight;
+      sendDone.ready();
+    }, [this](kj::Exception&& exception) {
+      // Usually just the tab going away.
+      KJ_LOG(INFO, "event socket send failed", exception);
+      shutdown();
+    }));
+  }
+
+  kj::Promise<void> acknowledge(kj::Promise<void>&& committed, kj::String id) {
+    auto ok = id.size() == 0 ? kj::str("ok\n") : kj::str("ok ", id, '\n');
+    auto error = id.size() == 0 ? kj::str("error\n") : kj::str("error ", id, '\n');
+    return committed.then([this, ok = kj::mv(ok)]() {
+      send(ok, "");
+    }, [this, error = kj::mv(error)](kj::Exception&& exception) {
+      send(error, exception.getDescription());
+    });
+  }
+
+  void shutdown() {
+    // Best-effort close frame (1011, internal error), then let go of the
+    // stream so the tab sees the socket end.
+    if (closed)
+      return;
+    send("", kj::StringPtr("\x03\xf3"), u::WS_CLOSE);
+    closed = true;
+    clientStream = nullptr;
+  }
+
+  void taskFailed(kj::Exception&& exception) override {
+    // Something broke while producing updates, so the tab would stop
+    // hearing about changes.
+    KJ_LOG(ERROR, "event socket", exception);
+    shutdown();
+  }
+
+  AppState* const appState;
+  const kj::String handle;
+  sandstorm::WebSession::WebSocketStream::Client clientStream;
+  u::WebSocketReader reader;
+  bool closed = false;
+  size_t inFlight = 0;
+  u::WaitQueue sendDone;
+  kj::TaskSet tasks;
+};
+
+
+template <typename AppState>
+class WebSessionImpl final: public sandstorm::WebSession::Server {
+ public:
+  WebSessionImpl(sandstorm::UserInfo::Reader userInfo,
+                 sandstorm::SessionContext::Client context,
+                 sandstorm::WebSession::Params::Reader params,
+                 capnp::Data::Reader tabId,
+                 AppState* appState):
+      appState(appState),
+      presence(appState->users, userInfo),
+      handle(presence.getHandle()),
+      polls(appState->polls) {
+#if SHOW_JOINS_PARTS
+    appState->chats.write(
+        kj::str(handle, " (", displayIdentity(userInfo, tabId),
+                ") has joined\n"));
+#endif
+  }
+
+  ~WebSessionImpl() noexcept(false) {
+#if SHOW_JOINS_PARTS
+    appState->chats.write(kj::str(handle, " has left\n"));
+#endif
+  }
+
+  kj::Promise<void> get(GetContext context) override {
+    kj::String path = kj::heapString(context.getParams().getPath());
+    kj::String query = kj::heapString("");
+    KJ_IF_MAYBE(qPos, path.findFirst('?')) {
+      query = kj::heapString(path.slice(*qPos + 1));
+      path = kj::heapString(path.slice(0, *qPos));
+    }
+#if METRICS
+    // Only content responses count, so unknown paths don't add routes.
+    auto route = kj::heapString(path == "" ? kj::StringPtr("index") : path);
+    return getPath(path, query, context).then([context, route = kj::mv(route)]() mutable {
+      auto results = context.getResults();
+      if (results.isContent() && results.getContent().getBody().isBytes())
+        u::metrics().responded(route, results.getContent().getBody().getBytes().size());
+    });
+#else
+    return getPath(path, query, context);
+#endif
+  }
+
+  kj::Promise<void> post(PostContext context) override {
+    auto path = context.getParams().getPath();
+    if (path == "chats") {
+      return postChat(appState, handle, context.getParams().getContent().getContent().asChars())
+          .then([context]() mutable {
+            return u::respondWithRedirect(context, "/");
+          });
+    }
+    return appRoute.post(kj::heapString(path), context, appState);
+  }
+
+  kj::Promise<void> put(PutContext context) override {
+    auto path = context.getParams().getPath();
+    requireCanonicalPath(path);
+    if (path == "topic") {
+      return setTopic(appState, handle, context.getParams().getContent().getContent().asChars())
+          .then([context]() mutable {
+            return u::respondWithRedirect(context, "/");
+          });
+    }
+    return u::respondWithNotFound(context);
+  }
+
+  kj::Promise<void> openWebSocket(OpenWebSocketContext context) override {
+    auto params = context.getParams();
+    KJ_REQUIRE(params.getPath() == "events", "No such WebSocket.", params.getPath());
+    context.getResults().setServerStream(
+        kj::heap<EventSocket<AppState>>(appState, handle, params.getClientStream()));
+    return kj::READY_NOW;
+  }
+
+ private:
+  kj::Promise<void> getPath(kj::String const& path, kj::StringPtr query, GetContext context) {
+    auto awaitNew = query == "new";
+    if (path == "")
+      return u::respondWith(context, appState->index.get(), "text/html", true);
+    if (path == "chats" && query.startsWith("since="))
+      return respondWithSince(context, appState->chats,
+                                   kj::heapString(query.slice(6)), polls);
+    if (path == "chats")
+      return respondWithObject(context, appState->chats, awaitNew, polls);
+    if (path == "users" && query.startsWith("since="))
+      return respondWithSince(context, appState->users, kj::heapString(query.slice(6)), polls);
+    if (path == "users")
+      return respondWithObject(context, appState->users, awaitNew, polls);
+    if (path == "topic")
+      return respondWithObject(context, appState->topic, awaitNew, polls);
+    return appRoute.get(path, query, context, appState);
+  }
+
+  void requireCanonicalPath(kj::StringPtr path) {
+    KJ_REQUIRE(!path.startsWith("/"));
+    KJ_REQUIRE(!path.startsWith("./") && path != ".");
+    KJ_REQUIRE(!path.startsWith("../") && path != "..");
+    KJ_IF_MAYBE(slashPos, path.findFirst('/')) {
+      requireCanonicalPath(path.slice(*slashPos + 1));
+    }
+  }
+
+  kj::String displayIdentity(sandstorm::UserInfo::Reader userInfo,
+                             capnp::Data::Reader tabId) {
+    kj::Vector<char> ret;
+    if (userInfo.hasDisplayName()) {
+      ret.addAll(u::filteredString(
+              [](char x){ return x != '\n'; },
+              userInfo.getDisplayName().getDefaultText()));
+      ret.add(' ');
+    }
+    if (userInfo.hasIdentityId()) {
+      ret.addAll(kj::StringPtr("user-"));
+      ret.addAll(u::showAsHex(userInfo.getIdentityId().slice(0, 8)));
+      ret.add(' ');
+      ret.addAll(kj::StringPtr("tab-"));
+      ret.addAll(u::showAsHex(tabId.slice(0, 4)));
+    } else {
+      ret.addAll(kj::StringPtr("tab-"));
+      ret.addAll(u::showAsHex(tabId));
+    }
+    return kj::String(ret.releaseAsArray());
+  }
+
+  AppState* const appState;
+  AppRoute<GetContext, PostContext, AppState> appRoute;
+  UserList::Presence presence;
+  const kj::StringPtr handle;
+  u::LongPolls::Session polls;
+};
+
+
+template <typename AppState>
+class UiViewImpl final: public sandstorm::UiView::Server {
+ public:
+  UiViewImpl(kj::Own<AppState>&& appState): appState(kj::mv(appState)) {}
+  kj::Promise<void> newSession(NewSessionContext context) override {
+    auto params = context.getParams();
+    KJ_REQUIRE(params.getSessionType() == capnp::typeId<sandstorm::WebSession>(),
+               "Unsupported session type.");
+
+    context.getResults().setSession(
+        kj::heap<WebSessionImpl<AppState>>(
+            params.getUserInfo(), params.getContext(),
+            params.getSessionParams().getAs<sandstorm::WebSession::Params>(),
+            params.getTabId(), appState));
+
+    return kj::READY_NOW;
+  }
+
+ private:
+  kj::Own<AppState> appState;
+};
+
+
+inline void initGrain() {
+  KJ_SYSCALL(mkdir("var/tmp", 0777));
+  u::writeFileAtomic(TOPIC_PATH, "Random chatter");
+  u::writeFileAtomic(CHATS_PATH, "");
+  u::writeFileAtomic(CHATSIZE_PATH, "0");
+  u::writeFileAtomic(CHATINDEX_PATH, "");
+}
+
+}   // namespace app
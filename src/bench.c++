@@ -0,0 +1,378 @@
+// Copyright 2016 Steven Dee. All rights reserved.
+
+// Load generator for serve. Runs the app in-process behind a capnp
+// socketpair, standing in for the Sandstorm supervisor, and prints one line
+// of JSON with throughput, post-to-delivery latency, bytes per delivery and
+// memory use.
+
+#include "app.h"
+
+#include <algorithm>
+#include <ftw.h>
+#include <capnp/rpc-twoparty.h>
+#include <kj/async-io.h>
+#include <kj/common.h>
+#include <kj/debug.h>
+#include <kj/main.h>
+#include <kj/string.h>
+#include <kj/vector.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+
+using app::DiskState;
+using app::MemState;
+using app::UiViewImpl;
+using sandstorm::WebSession;
+
+constexpr auto RETRY_DELAY = 1 * kj::SECONDS;
+
+uint64_t nowNs() {
+  struct timespec ts;
+  KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t procStatusKb(kj::StringPtr field) {
+  // Reads e.g. VmRSS out of /proc/self/status. Returns 0 if it's not there.
+  // procfs reports a size of 0, so this can't go through u::readFile.
+  char buf[8192];
+  kj::FdInputStream in(u::raiiOpen("/proc/self/status", O_RDONLY));
+  auto n = in.tryRead(buf, 1, sizeof(buf) - 1);
+  buf[n] = '\0';
+  kj::StringPtr rest(buf, n);
+  for (;;) {
+    if (rest.startsWith(field) && rest.size() > field.size() && rest[field.size()] == ':')
+      return strtoull(rest.cStr() + field.size() + 1, nullptr, 10);
+    KJ_IF_MAYBE(nlPos, rest.findFirst('\n')) {
+      rest = rest.slice(*nlPos + 1);
+    } else {
+      return 0;
+    }
+  }
+}
+
+uint64_t percentile(kj::ArrayPtr<const uint64_t> sorted, double p) {
+  if (sorted.size() == 0)
+    return 0;
+  return sorted[kj::min(sorted.size() - 1, size_t(p * sorted.size()))];
+}
+
+void removeTree(kj::StringPtr path) {
+  // rm -rf, for the grain directory the bench made itself.
+  auto removeOne = [](const char* name, const struct stat*, int, struct FTW*) {
+    return remove(name);
+  };
+  KJ_SYSCALL(nftw(path.cStr(), removeOne, 16, FTW_DEPTH | FTW_PHYS), path);
+}
+
+class Bench {
+ public:
+  Bench(kj::ProcessContext& context): context(context), ioContext(kj::setupAsyncIo()) {}
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "serve benchmark",
+                           "Drives an in-process serve over a capnp socketpair and prints one "
+                           "line of JSON results.")
+        .addOptionWithArg({'m', "mode"}, KJ_BIND_METHOD(*this, setMode), "<mem|disk>",
+                          "Off-the-record (MemState) or logged (DiskState). Default mem.")
+        .addOptionWithArg({'d', "dir"}, KJ_BIND_METHOD(*this, setDir), "<dir>",
+                          "Grain directory to create; put it on tmpfs or a real disk. "
+                          "Default: a new directory in /tmp, removed on exit.")
+        .addOptionWithArg({'s', "sessions"}, KJ_BIND_METHOD(*this, setSessions), "<n>",
+                          "Sessions, each long-polling chats. Default 10.")
+        .addOptionWithArg({'p', "posts"}, KJ_BIND_METHOD(*this, setPosts), "<n>",
+                          "Chats to post in total. Default 1000.")
+        .addOptionWithArg({'c', "concurrency"}, KJ_BIND_METHOD(*this, setConcurrency), "<n>",
+                          "Posts in flight at once. Default 4.")
+        .addOptionWithArg({'t', "topic-every"}, KJ_BIND_METHOD(*this, setTopicEvery), "<n>",
+                          "Also put the topic every n posts. Default 0 (never).")
+        .addOption({'w', "watch-all"}, KJ_BIND_METHOD(*this, setWatchAll),
+                   "Also long-poll users?new and topic?new in every session.")
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+  kj::MainBuilder::Validity setMode(kj::StringPtr arg) {
+    if (arg != "mem" && arg != "disk")
+      return "mode must be mem or disk";
+    disk = arg == "disk";
+    return true;
+  }
+
+  kj::MainBuilder::Validity setDir(kj::StringPtr arg) {
+    dir = kj::heapString(arg);
+    return true;
+  }
+
+  kj::MainBuilder::Validity setSessions(kj::StringPtr arg) {
+    return parseCount(arg, sessionCount, 1);
+  }
+
+  kj::MainBuilder::Validity setPosts(kj::StringPtr arg) {
+    return parseCount(arg, posts, 1);
+  }
+
+  kj::MainBuilder::Validity setConcurrency(kj::StringPtr arg) {
+    return parseCount(arg, concurrency, 1);
+  }
+
+  kj::MainBuilder::Validity setTopicEvery(kj::StringPtr arg) {
+    return parseCount(arg, topicEvery, 0);
+  }
+
+  kj::MainBuilder::Validity setWatchAll() {
+    watchAll = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity run() {
+    if (dir == nullptr) {
+      dir = kj::str("/tmp/serve-bench.XXXXXX");
+      KJ_ASSERT(mkdtemp(dir.begin()) != nullptr, "mkdtemp", errno);
+      madeDir = true;
+    } else {
+      KJ_SYSCALL(mkdir(dir.cStr(), 0777), dir);
+    }
+    KJ_SYSCALL(chdir(dir.cStr()), dir);
+    KJ_SYSCALL(mkdir("var", 0777));
+    if (disk) {
+      app::initGrain();
+    } else {
+      KJ_SYSCALL(mkdir("var/tmp", 0777));
+    }
+    KJ_DEFER(cleanUp());
+    u::writeFileAtomic(app::INDEX_PATH, "");
+
+    if (disk) {
+      runWith(kj::heap<DiskState>(ioContext.provider->getTimer()));
+    } else {
+      runWith(kj::heap<MemState>(ioContext.provider->getTimer()));
+    }
+    return true;
+  }
+
+ private:
+  struct Session {
+    WebSession::Client client;
+    kj::String cursor = kj::heapString("");
+    uint64_t seen = 0;
+  };
+
+  void cleanUp() {
+    // Removes the grain directory unless it came from --dir. Called before
+    // exitInfo() too, since that exits without unwinding.
+    if (madeDir) {
+      madeDir = false;
+      removeTree(dir);
+    }
+  }
+
+  kj::MainBuilder::Validity parseCount(kj::StringPtr arg, uint64_t& out, uint64_t min) {
+    KJ_IF_MAYBE(n, u::tryParseUint(arg)) {
+      if (*n >= min) {
+        out = *n;
+        return true;
+      }
+    }
+    return "expected a number";
+  }
+
+  template <typename AppState>
+  void runWith(kj::Own<AppState>&& appState) {
+    int fds[2];
+    KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    auto flags = kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP;
+    auto appStream = ioContext.lowLevelProvider->wrapSocketFd(fds[0], flags);
+    auto supervisorStream = ioContext.lowLevelProvider->wrapSocketFd(fds[1], flags);
+
+    // Only the SERVER side of a two-party network accepts the connection, so
+    // the app takes that role here rather than the one it has under Sandstorm.
+    capnp::TwoPartyVatNetwork appNetwork(*appStream, capnp::rpc::twoparty::Side::SERVER);
+    auto appRpc = capnp::makeRpcServer(
+        appNetwork, kj::heap<UiViewImpl<AppState>>(kj::mv(appState)));
+    capnp::TwoPartyVatNetwork supervisorNetwork(*supervisorStream,
+                                                capnp::rpc::twoparty::Side::CLIENT);
+    auto supervisorRpc = capnp::makeRpcClient(supervisorNetwork);
+
+    capnp::MallocMessageBuilder message;
+    auto vatId = message.getRoot<capnp::rpc::twoparty::VatId>();
+    vatId.setSide(capnp::rpc::twoparty::Side::SERVER);
+    auto uiView = supervisorRpc.bootstrap(vatId).castAs<sandstorm::UiView>();
+
+    for (uint64_t i = 0; i < sessionCount; ++i) {
+      auto req = uiView.newSessionRequest();
+      auto handle = kj::str("bench", i);
+      req.getUserInfo().setPreferredHandle(handle);
+      req.getUserInfo().setIdentityId(kj::str("identity", i, "-0123456789abcdef").asBytes());
+      req.setSessionType(capnp::typeId<WebSession>());
+      req.getSessionParams().initAs<WebSession::Params>();
+      req.setTabId(kj::str("tab", i, "-0123456789").asBytes());
+      sessions.add(Session{
+          req.send().wait(ioContext.waitScope).getSession().castAs<WebSession>()});
+    }
+    sendTimes = kj::heapArray<uint64_t>(posts);
+
+    kj::Vector<kj::Promise<void>> work;
+    kj::Vector<kj::Promise<void>> watchers;
+    for (auto& session: sessions) {
+      work.add(pollChats(session));
+      if (watchAll) {
+        watchers.add(pollObject(session, "users?new"));
+        watchers.add(pollObject(session, "topic?new"));
+      }
+    }
+    start = nowNs();
+    for (uint64_t i = 0; i < concurrency; ++i) {
+      work.add(postLoop());
+    }
+    kj::joinPromises(work.releaseAsArray()).wait(ioContext.waitScope);
+    auto elapsed = (lastDelivery - start) / 1e9;
+
+    std::sort(latencies.begin(), latencies.end());
+    auto lat = latencies.asPtr();
+    auto result = kj::str(
+        "{\"mode\": \"", disk ? "disk" : "mem", "\", ",
+        "\"dir\": \"", dir, "\", ",
+        "\"sessions\": ", sessionCount, ", ",
+        "\"posts\": ", posts, ", ",
+        "\"concurrency\": ", concurrency, ", ",
+        "\"topic_every\": ", topicEvery, ", ",
+        "\"watch_all\": ", watchAll ? "true" : "false", ", ",
+        "\"elapsed_s\": ", elapsed, ", ",
+        "\"posts_per_s\": ", posts / elapsed, ", ",
+        "\"deliveries\": ", latencies.size(), ", ",
+        "\"deliveries_per_s\": ", latencies.size() / elapsed, ", ",
+        "\"latency_us\": {",
+            "\"p50\": ", percentile(lat, 0.5) / 1000, ", ",
+            "\"p99\": ", percentile(lat, 0.99) / 1000, ", ",
+            "\"p999\": ", percentile(lat, 0.999) / 1000, ", ",
+            "\"max\": ", (lat.size() ? lat[lat.size() - 1] : 0) / 1000, "}, ",
+        "\"bytes_per_delivery\": ", double(chatBytes) / kj::max(latencies.size(), 1), ", ",
+        "\"refused_polls\": ", refusedPolls, ", ",
+        "\"rss_kb\": ", procStatusKb("VmRSS"), ", ",
+        "\"peak_rss_kb\": ", procStatusKb("VmHWM"), "}");
+    cleanUp();
+    context.exitInfo(result);
+  }
+
+  kj::Promise<void> postLoop() {
+    if (nextPost == posts)
+      return kj::READY_NOW;
+    auto seq = nextPost++;
+    auto& session = sessions[seq % sessions.size()];
+    kj::Promise<void> ready = kj::READY_NOW;
+    if (topicEvery != 0 && seq % topicEvery == 0) {
+      auto req = session.client.putRequest();
+      req.setPath("topic");
+      req.getContent().setContent(kj::str("topic ", seq).asBytes());
+      ready = req.send().then([](auto&&) {});
+    }
+    return ready.then([this, seq, &session]()
+                          -> kj::Promise<capnp::Response<WebSession::Response>> {
+      auto req = session.client.postRequest();
+      req.setPath("chats");
+      req.getContent().setContent(kj::str("m", seq).asBytes());
+      sendTimes[seq] = nowNs();
+      return req.send();
+    }).then([this](auto&& response) {
+      KJ_REQUIRE(response.isRedirect(), "post failed");
+      return postLoop();
+    });
+  }
+
+  kj::Promise<void> pollChats(Session& session) {
+    if (session.seen == posts)
+      return kj::READY_NOW;
+    auto req = session.client.getRequest();
+    req.setPath(kj::str("chats?since=", session.cursor));
+    return req.send().then([this, &session](auto&& response) {
+      if (response.isContent()) {
+        auto now = nowNs();
+        auto body = response.getContent().getBody().getBytes().asChars();
+        chatBytes += body.size();
+        receive(session, kj::heapString(body), now);
+        lastDelivery = now;
+      }
+      return retryAfter(response).then([this, &session]() {
+        return pollChats(session);
+      });
+    });
+  }
+
+  template <typename Response>
+  kj::Promise<void> retryAfter(Response& response) {
+    // Back off from a refused poll (the grain is at MAX_POLLS) like a tab.
+    if (!response.isServerError())
+      return kj::READY_NOW;
+    ++refusedPolls;
+    return ioContext.provider->getTimer().afterDelay(RETRY_DELAY);
+  }
+
+  void receive(Session& session, kj::StringPtr body, uint64_t now) {
+    // body is "full <cursor>" or "delta <cursor>", a newline, then chat
+    // lines. Ours look like "<handle>: m<seq>".
+    KJ_IF_MAYBE(nlPos, body.findFirst('\n')) {
+      KJ_IF_MAYBE(spPos, body.findFirst(' ')) {
+        if (*spPos < *nlPos)
+          session.cursor = kj::heapString(body.begin() + *spPos + 1, *nlPos - *spPos - 1);
+      }
+      auto rest = body.slice(*nlPos + 1);
+      while (rest.size() > 0) {
+        size_t end = rest.size() - 1;
+        KJ_IF_MAYBE(linePos, rest.findFirst('\n')) {
+          end = *linePos;
+        }
+        auto line = kj::heapString(rest.begin(), end);
+        KJ_IF_MAYBE(pos, line.findFirst(':')) {
+          auto text = line.slice(*pos + 1);
+          if (text.startsWith(" m")) {
+            KJ_IF_MAYBE(seq, u::tryParseUint(text.slice(2))) {
+              latencies.add(now - sendTimes[*seq]);
+              ++session.seen;
+            }
+          }
+        }
+        rest = rest.slice(end + 1);
+      }
+    }
+  }
+
+  kj::Promise<void> pollObject(Session& session, kj::StringPtr path) {
+    auto req = session.client.getRequest();
+    req.setPath(path);
+    return req.send().then([this, &session, path](auto&& response) {
+      return retryAfter(response).then([this, &session, path]() {
+        return pollObject(session, path);
+      });
+    });
+  }
+
+  kj::ProcessContext& context;
+  kj::AsyncIoContext ioContext;
+
+  bool disk = false;
+  kj::String dir;
+  bool madeDir = false;
+  uint64_t sessionCount = 10;
+  uint64_t posts = 1000;
+  uint64_t concurrency = 4;
+  uint64_t topicEvery = 0;
+  bool watchAll = false;
+
+  kj::Vector<Session> sessions;
+  kj::Array<uint64_t> sendTimes;
+  uint64_t nextPost = 0;
+  uint64_t start = 0;
+  uint64_t lastDelivery = 0;
+  uint64_t chatBytes = 0;
+  uint64_t refusedPolls = 0;
+  kj::Vector<uint64_t> latencies;
+};
+
+}   // namespace
+
+KJ_MAIN(Bench)
@@ -0,0 +1,106 @@
+// Copyright 2016 Steven Dee. All rights reserved.
+
+#pragma once
+
+// Process-wide counters and latency histograms behind GET metrics. Only built
+// when METRICS is set in src/BUILD; otherwise the macros below leave just the
+// measured statement behind, so instrumented code costs nothing.
+
+#if METRICS
+
+#include <kj/common.h>
+#include <kj/debug.h>
+#include <kj/string.h>
+#include <kj/vector.h>
+#include <map>
+#include <time.h>
+
+namespace u {
+
+inline uint64_t monotonicNs() {
+  struct timespec ts;
+  KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+class Histogram {
+  // Durations in power-of-two microsecond buckets: bucket i counts samples
+  // under 2^i us, and the last one takes everything slower.
+ public:
+  void record(uint64_t ns) {
+    auto us = ns / 1000;
+    size_t i = 0;
+    while (i + 1 < BUCKETS && us >= (uint64_t(1) << i)) ++i;
+    ++buckets[i];
+    ++count;
+    sumUs += us;
+    maxUs = kj::max(maxUs, us);
+  }
+
+  kj::String toJson() const {
+    // Bucket keys are upper bounds in us; empty buckets are left out.
+    kj::Vector<kj::String> nonEmpty;
+    for (size_t i = 0; i < BUCKETS; ++i) {
+      if (buckets[i] != 0) {
+        auto bound = i + 1 < BUCKETS ? kj::str(uint64_t(1) << i) : kj::str("inf");
+        nonEmpty.add(kj::str('"', bound, "\": ", buckets[i]));
+      }
+    }
+    return kj::str("{\"count\": ", count, ", \"sum_us\": ", sumUs, ", \"max_us\": ", maxUs,
+                   ", \"buckets\": {", kj::strArray(nonEmpty, ", "), "}}");
+  }
+
+ private:
+  static constexpr size_t BUCKETS = 25;   // the last finite bound is ~8s
+
+  uint64_t buckets[BUCKETS] = {};
+  uint64_t count = 0;
+  uint64_t sumUs = 0;
+  uint64_t maxUs = 0;
+};
+
+struct Metrics {
+  Histogram fsync;     // each fdatasync, of a file or a directory
+  Histogram rename;    // writeFileAtomic's rename
+  Histogram commit;    // a whole DiskStream batch, fsyncs included
+  Histogram wake;      // one WaitQueue batch of WAKE_BATCH fulfills
+  Histogram respond;   // copying a body into a response
+  uint64_t messagesWritten = 0;
+  uint64_t bytesWritten = 0;
+  uint64_t batchesCommitted = 0;
+  uint64_t startupNs = 0;
+  std::map<kj::String, uint64_t, std::less<>> responseBytes;   // by route
+
+  void responded(kj::StringPtr route, uint64_t bytes) {
+    auto iter = responseBytes.find(route);
+    if (iter == responseBytes.end())
+      iter = responseBytes.emplace(kj::heapString(route), 0).first;
+    iter->second += bytes;
+  }
+};
+
+inline Metrics& metrics() {
+  static Metrics instance;
+  return instance;
+}
+
+}   // namespace u
+
+// METRICS_TIME(fsync, KJ_SYSCALL(fdatasync(fd))) runs the statement and
+// records how long it took in u::metrics().fsync.
+#define METRICS_TIME(histogram, ...) \
+  do { \
+    auto _metricsStart = ::u::monotonicNs(); \
+    __VA_ARGS__; \
+    ::u::metrics().histogram.record(::u::monotonicNs() - _metricsStart); \
+  } while (false)
+
+// METRICS_DO(u::metrics().bytesWritten += n) -- dropped entirely when off.
+#define METRICS_DO(...) do { __VA_ARGS__; } while (false)
+
+#else
+
+#define METRICS_TIME(histogram, ...) do { __VA_ARGS__; } while (false)
+#define METRICS_DO(...) do {} while (false)
+
+#endif  // METRICS
@@ -2,6 +2,7 @@
 
 #pragma once
 
+#include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <dirent.h>
@@ -9,36 +10,253 @@
 #include <kj/async.h>
 #include <kj/common.h>
 #include <kj/debug.h>
+#include <kj/function.h>
 #include <kj/io.h>
+#include <kj/refcount.h>
+#include <kj/time.h>
 #include <kj/vector.h>
+#include <list>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <sandstorm/web-session.capnp.h>
 
+#include "metrics.h"
+
 typedef unsigned char byte;
 
 namespace u {
 
-class WaitQueue {
+class WaitQueue: private kj::TaskSet::ErrorHandler {
+  // Promises from wait() resolve on the next ready(). A canceled wait is
+  // unlinked immediately. A big ready() wakes WAKE_BATCH waiters at a time,
+  // going back to the event port between batches (see drain()), so one
+  // broadcast can't keep incoming requests from being read. `drained` runs
+  // once everyone a ready() woke has had their turn.
  public:
+  WaitQueue(kj::Timer& timer, kj::Function<void()> drained = []() {}):
+      timer(timer), drained(kj::mv(drained)), tasks(*this) {}
+  KJ_DISALLOW_COPY(WaitQueue);
+
+  ~WaitQueue() noexcept(false) {
+    // Outstanding waits just never resolve.
+    for (auto waiter: waiting) waiter->linked = false;
+    for (auto waiter: waking) waiter->linked = false;
+  }
+
   inline kj::Promise<void> wait() {
     // Returns a promise that resolves when ready() is called.
-    auto ret = kj::newPromiseAndFulfiller<void>();
-    requests.add(kj::mv(ret.fulfiller));
-    return kj::mv(ret.promise);
+    return kj::newAdaptedPromise<void, Waiter>(*this);
   }
 
   inline void ready() {
-    for (auto& request: requests) {
-      request->fulfill();
+    for (auto waiter: waiting) waiter->isWaking = true;
+    waking.splice(waking.end(), waiting);
+    if (!draining) {
+      draining = true;
+      drain();
+    }
+  }
+
+  size_t size() const {
+    return waiting.size() + waking.size();
+  }
+
+  bool isDraining() const {
+    // True from ready() until `drained` runs.
+    return draining;
+  }
+
+ private:
+  static constexpr size_t WAKE_BATCH = 64;
+
+  class Waiter {
+   public:
+    Waiter(kj::PromiseFulfiller<void>& fulfiller, WaitQueue& queue):
+        fulfiller(fulfiller),
+        queue(queue),
+        pos(queue.waiting.insert(queue.waiting.end(), this)) {}
+
+    ~Waiter() {
+      if (linked)
+        (isWaking ? queue.waking : queue.waiting).erase(pos);
+    }
+
+    kj::PromiseFulfiller<void>& fulfiller;
+    WaitQueue& queue;
+    std::list<Waiter*>::iterator pos;
+    bool linked = true;
+    bool isWaking = false;
+  };
+
+  void drain() {
+    // evalLater() wouldn't do here: kj only polls for I/O once its queue
+    // is empty, and each batch queues more work. Timers are fired from the
+    // same epoll_wait() that reports readable sockets, so a zero delay
+    // lets pending requests in ahead of the next batch. By the turn that
+    // finds nothing left, the last batch's continuations have all run.
+    if (waking.empty()) {
+      draining = false;
+      drained();
+      return;
+    }
+    METRICS_TIME(wake, wakeBatch());
+    tasks.add(timer.afterDelay(0 * kj::NANOSECONDS).then([this]() { drain(); }));
+  }
+
+  void wakeBatch() {
+    for (size_t i = 0; i < WAKE_BATCH && !waking.empty(); ++i) {
+      auto waiter = waking.front();
+      waking.pop_front();
+      waiter->linked = false;
+      waiter->fulfiller.fulfill();
     }
-    requests.clear();
+  }
+
+  void taskFailed(kj::Exception&& exception) override {
+    KJ_LOG(ERROR, "wait queue", exception);
+  }
+
+  kj::Timer& timer;
+  kj::Function<void()> drained;
+  std::list<Waiter*> waiting;
+  std::list<Waiter*> waking;
+  bool draining = false;
+  kj::TaskSet tasks;
+};
+
+class LongPolls {
+  // Keeps parked long-polls in check. Each parked request resolves to true
+  // when its event fires, or to false -- "no change, ask again" -- after
+  // `timeout`, or early when it's shed to keep a session under
+  // `maxPerSession`; the session's oldest poll goes first. Once the grain has
+  // `maxTotal`, new polls are refused instead (see canPark()): shedding one
+  // to make room would only have it asked again straight away.
+  struct Poll;
+
+ public:
+  LongPolls(kj::Timer& timer, kj::Duration timeout, size_t maxPerSession, size_t maxTotal):
+      timer(timer), timeout(timeout), maxPerSession(maxPerSession), maxTotal(maxTotal) {}
+  KJ_DISALLOW_COPY(LongPolls);
+
+  size_t size() const {
+    return all.size();
+  }
+
+  class Session {
+   public:
+    Session(LongPolls& polls): polls(polls) {}
+    KJ_DISALLOW_COPY(Session);
+    inline ~Session() noexcept(false);
+
+    inline bool canPark() const;
+    inline kj::Promise<bool> park(kj::Promise<void>&& event);
+
+   private:
+    friend struct LongPolls::Poll;
+    LongPolls& polls;
+    std::list<Poll*> mine;
+  };
+
+ private:
+  struct Poll {
+    Poll(LongPolls& polls, Session& session, kj::Own<kj::PromiseFulfiller<bool>>&& shedder):
+        polls(polls),
+        session(&session),
+        shedder(kj::mv(shedder)),
+        allPos(polls.all.insert(polls.all.end(), this)),
+        sessionPos(session.mine.insert(session.mine.end(), this)) {}
+
+    ~Poll() {
+      unlink();
+    }
+
+    void unlink() {
+      if (!linked)
+        return;
+      polls.all.erase(allPos);
+      if (session != nullptr)
+        session->mine.erase(sessionPos);
+      linked = false;
+    }
+
+    void shed() {
+      unlink();
+      shedder->fulfill(false);
+    }
+
+    LongPolls& polls;
+    Session* session;
+    kj::Own<kj::PromiseFulfiller<bool>> shedder;
+    std::list<Poll*>::iterator allPos;
+    std::list<Poll*>::iterator sessionPos;
+    bool linked = true;
+  };
+
+  kj::Timer& timer;
+  const kj::Duration timeout;
+  const size_t maxPerSession;
+  const size_t maxTotal;
+  std::list<Poll*> all;
+};
+
+inline LongPolls::Session::~Session() noexcept(false) {
+  for (auto poll: mine) poll->session = nullptr;
+}
+
+inline bool LongPolls::Session::canPark() const {
+  // A session at its own limit makes room by shedding one of its polls.
+  return polls.all.size() < polls.maxTotal || mine.size() >= polls.maxPerSession;
+}
+
+inline kj::Promise<bool> LongPolls::Session::park(kj::Promise<void>&& event) {
+  KJ_REQUIRE(canPark(), "too many long-polls");
+  if (mine.size() >= polls.maxPerSession)
+    mine.front()->shed();
+  auto shed = kj::newPromiseAndFulfiller<bool>();
+  auto poll = kj::heap<Poll>(polls, *this, kj::mv(shed.fulfiller));
+  return event.then([]() { return true; })
+      .exclusiveJoin(polls.timer.afterDelay(polls.timeout).then([]() { return false; }))
+      .exclusiveJoin(kj::mv(shed.promise))
+      .attach(kj::mv(poll));
+}
+
+class Snapshot final: public kj::Refcounted {
+  // An immutable response body, shared by every request that sees the same
+  // state of some object.
+ public:
+  Snapshot(kj::String&& body): body(kj::mv(body)) {}
+
+  const kj::String body;
+};
+
+class SnapshotCache {
+  // Holds the snapshot for the current state of an object, so it's built at
+  // most once per change no matter how many requests want it. `key`
+  // distinguishes bodies that depend on the request, e.g. a start offset;
+  // only the most recent key is kept.
+ public:
+  template <typename Func>
+  kj::Own<Snapshot> get(Func&& build, uint64_t key = 0) {
+    KJ_IF_MAYBE(s, snapshot) {
+      if (snapshotKey == key)
+        return kj::addRef(**s);
+    }
+    auto ret = kj::refcounted<Snapshot>(build());
+    snapshot = kj::addRef(*ret);
+    snapshotKey = key;
+    return kj::mv(ret);
+  }
+
+  void invalidate() {
+    snapshot = nullptr;
   }
 
  private:
-  kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> requests;
+  kj::Maybe<kj::Own<Snapshot>> snapshot;
+  uint64_t snapshotKey = 0;
 };
 
 inline kj::AutoCloseFd raiiOpen(kj::StringPtr name, int flags, mode_t mode = 0666) {
@@ -63,6 +281,94 @@ inline kj::String readFile(kj::StringPtr filename) {
   return kj::mv(ret);
 }
 
+inline uint64_t randomEpoch() {
+  // A cursor epoch that won't match any handed out by an earlier run, even
+  // one that started within the same second.
+  uint64_t ret;
+  kj::FdInputStream(raiiOpen("/dev/urandom", O_RDONLY)).read(&ret, sizeof(ret));
+  return ret;
+}
+
+inline kj::Maybe<uint64_t> tryParseUint(kj::StringPtr s) {
+  // Like s.parseAs<uint64_t>(), but returns null instead of throwing.
+  if (s.size() == 0 || s[0] < '0' || s[0] > '9')
+    return nullptr;
+  char* end;
+  errno = 0;
+  auto ret = strtoull(s.cStr(), &end, 10);
+  if (errno != 0 || end != s.end())
+    return nullptr;
+  return static_cast<uint64_t>(ret);
+}
+
+inline kj::String decodeQueryValue(kj::ArrayPtr<const char> value) {
+  // Undoes form encoding: '+' is a space and %XX a byte. Malformed escapes
+  // are kept as they are.
+  auto hexDigit = [](char c) -> int {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+  };
+  kj::Vector<char> ret(value.size() + 1);
+  for (size_t i = 0; i < value.size(); ++i) {
+    if (value[i] == '+') {
+      ret.add(' ');
+    } else if (value[i] == '%' && i + 2 < value.size() &&
+               hexDigit(value[i + 1]) >= 0 && hexDigit(value[i + 2]) >= 0) {
+      ret.add(hexDigit(value[i + 1]) * 16 + hexDigit(value[i + 2]));
+      i += 2;
+    } else {
+      ret.add(value[i]);
+    }
+  }
+  ret.add('\0');
+  return kj::String(ret.releaseAsArray());
+}
+
+struct StringHash {
+  // FNV-1a, for unordered containers keyed by kj::String.
+  size_t operator()(kj::StringPtr s) const {
+    uint64_t h = 14695981039346656037ull;
+    for (auto c: s) {
+      h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    return h;
+  }
+};
+
+inline void pwriteAll(int fd, kj::ArrayPtr<const char> data, uint64_t offset) {
+  while (data.size() > 0) {
+    ssize_t n;
+    KJ_SYSCALL(n = pwrite(fd, data.begin(), data.size(), offset));
+    data = data.slice(n, data.size());
+    offset += n;
+  }
+}
+
+class MmapDisposer: public kj::ArrayDisposer {
+ protected:
+  void disposeImpl(void* firstElement, size_t elementSize, size_t elementCount,
+                   size_t capacity, void (*destroyElement)(void*)) const override {
+    // firstElement may be partway into the first page; see mapFile().
+    auto addr = reinterpret_cast<uintptr_t>(firstElement);
+    auto base = addr - addr % sysconf(_SC_PAGESIZE);
+    KJ_SYSCALL(munmap(reinterpret_cast<void*>(base), addr - base + elementSize * elementCount));
+  }
+};
+
+inline kj::Array<const char> mapFile(int fd, uint64_t offset, size_t size) {
+  // Maps [offset, offset + size) of fd read-only. Unmapped when dropped.
+  static const MmapDisposer disposer;
+  if (size == 0)
+    return nullptr;
+  auto pageOffset = offset % sysconf(_SC_PAGESIZE);
+  void* base = mmap(nullptr, size + pageOffset, PROT_READ, MAP_PRIVATE, fd, offset - pageOffset);
+  if (base == MAP_FAILED)
+    KJ_FAIL_SYSCALL("mmap", errno, offset, size);
+  return kj::Array<const char>(reinterpret_cast<const char*>(base) + pageOffset, size, disposer);
+}
+
 inline kj::String dirName(kj::StringPtr path) {
   KJ_IF_MAYBE(slashPos, path.findLast('/')) {
     return kj::heapString(path.slice(0, *slashPos));
@@ -78,22 +384,29 @@ inline void syncPath(kj::StringPtr pathname) {
 
   {
     auto fd = raiiOpen(pathname, O_RDONLY);
-    KJ_SYSCALL(fdatasync(fd));
+    METRICS_TIME(fsync, KJ_SYSCALL(fdatasync(fd)));
   }
   syncPath(dirName(pathname));
 }
 
+inline void syncDir(kj::StringPtr dirname) {
+  auto fd = raiiOpen(dirname == "" ? "." : dirname, O_RDONLY);
+  METRICS_TIME(fsync, KJ_SYSCALL(fdatasync(fd)));
+}
+
 inline void writeFileAtomic(kj::StringPtr filename, kj::StringPtr content) {
-  auto name = kj::str("/var/tmp/tmp.XXXXXX");
+  auto name = kj::str("var/tmp/tmp.XXXXXX");
   int fd;
   KJ_SYSCALL(fd = mkstemp(name.begin()), name);
   {
     kj::FdOutputStream stream{kj::AutoCloseFd(fd)};   // XX most vexing parse
     stream.write(reinterpret_cast<const byte*>(content.begin()), content.size());
-    fdatasync(fd);
+    METRICS_TIME(fsync, fdatasync(fd));
   }
-  syncPath(dirName(name));
-  KJ_SYSCALL(rename(name.cStr(), filename.cStr()));
+  METRICS_TIME(rename, KJ_SYSCALL(rename(name.cStr(), filename.cStr())));
+  // Only the new directory entry has to be durable; the temp file's never
+  // matters, and the parents already exist.
+  syncDir(dirName(filename));
 }
 
 inline void removeAllFiles(kj::StringPtr dirname) {
@@ -129,7 +442,21 @@ kj::Promise<void> respondWith(Context ctx, kj::StringPtr body, kj::StringPtr mim
   response.setMimeType(mimeType);
   if (gzip)
     response.setEncoding("gzip");
-  response.getBody().setBytes(body.asBytes());
+  METRICS_TIME(respond, response.getBody().setBytes(body.asBytes()));
+  return kj::READY_NOW;
+}
+
+template <typename Context>
+kj::Promise<void> respondWithPrefixed(Context ctx, kj::StringPtr prefix, kj::StringPtr body,
+                                      kj::StringPtr mimeType) {
+  // Like respondWith(ctx, kj::str(prefix, body), mimeType) without the
+  // intermediate copy.
+  auto response = ctx.getResults().initContent();
+  response.setMimeType(mimeType);
+  METRICS_TIME(respond,
+    auto bytes = response.getBody().initBytes(prefix.size() + body.size());
+    memcpy(bytes.begin(), prefix.begin(), prefix.size());
+    memcpy(bytes.begin() + prefix.size(), body.begin(), body.size()));
   return kj::READY_NOW;
 }
 
@@ -142,6 +469,20 @@ kj::Promise<void> respondWithRedirect(Context context, kj::StringPtr location) {
   return kj::READY_NOW;
 }
 
+template <typename Context>
+kj::Promise<void> respondWithNoContent(Context context) {
+  context.getResults().initNoContent();
+  return kj::READY_NOW;
+}
+
+template <typename Context>
+kj::Promise<void> respondWithOverloaded(Context context) {
+  // Sandstorm only passes a plain 500 through, so that's what the tab backs
+  // off from.
+  context.getResults().initServerError().setDescriptionHtml("Too busy; try again later.");
+  return kj::READY_NOW;
+}
+
 template <typename Context>
 kj::Promise<void> respondWithNotFound(Context context) {
   auto response = context.getResults().initClientError();
@@ -149,6 +490,119 @@ kj::Promise<void> respondWithNotFound(Context context) {
   return kj::READY_NOW;
 }
 
+constexpr byte WS_CONTINUATION = 0x0;
+constexpr byte WS_TEXT = 0x1;
+constexpr byte WS_CLOSE = 0x8;
+constexpr byte WS_PING = 0x9;
+constexpr byte WS_PONG = 0xa;
+
+inline size_t webSocketHeader(byte* out, byte opcode, uint64_t size) {
+  // Writes the header of a single, unmasked (i.e. server-to-client) frame.
+  // out must have room for 10 bytes. Returns the header length.
+  out[0] = 0x80 | opcode;
+  if (size < 126) {
+    out[1] = size;
+    return 2;
+  } else if (size <= 0xffff) {
+    out[1] = 126;
+    out[2] = size >> 8;
+    out[3] = size;
+    return 4;
+  }
+  out[1] = 127;
+  for (auto i = 0; i < 8; ++i) {
+    out[2 + i] = size >> (56 - 8 * i);
+  }
+  return 10;
+}
+
+class WebSocketReader {
+  // Reassembles WebSocket messages from the raw client-to-server bytes the
+  // Sandstorm bridge hands us. Control frames come out as soon as they're
+  // complete, even in the middle of a fragmented message.
+ public:
+  struct Message {
+    byte opcode;
+    kj::Array<byte> payload;
+  };
+
+  WebSocketReader(size_t maxMessageSize): maxMessageSize(maxMessageSize) {}
+
+  void feed(kj::ArrayPtr<const byte> bytes) {
+    buffer.addAll(bytes);
+  }
+
+  kj::Maybe<Message> next() {
+    // Returns the next complete message, or null if more bytes are needed.
+    for (;;) {
+      auto avail = buffer.size() - pos;
+      if (avail < 2)
+        break;
+      auto frame = buffer.begin() + pos;
+      bool fin = frame[0] & 0x80;
+      byte opcode = frame[0] & 0x0f;
+      bool masked = frame[1] & 0x80;
+      uint64_t size = frame[1] & 0x7f;
+      size_t headerSize = 2;
+      if (size == 126) {
+        headerSize = 4;
+        if (avail < headerSize)
+          break;
+        size = (uint64_t(frame[2]) << 8) | frame[3];
+      } else if (size == 127) {
+        headerSize = 10;
+        if (avail < headerSize)
+          break;
+        size = 0;
+        for (auto i = 0; i < 8; ++i) {
+          size = (size << 8) | frame[2 + i];
+        }
+      }
+      KJ_REQUIRE(size <= maxMessageSize, "WebSocket frame too large", size);
+      auto mask = frame + headerSize;
+      if (masked)
+        headerSize += 4;
+      if (avail < headerSize + size)
+        break;
+
+      auto payload = kj::heapArray<byte>(frame + headerSize, size);
+      if (masked) {
+        for (size_t i = 0; i < size; ++i) {
+          payload[i] ^= mask[i % 4];
+        }
+      }
+      pos += headerSize + size;
+
+      if (opcode >= WS_CLOSE)
+        return Message{opcode, kj::mv(payload)};
+      if (opcode != WS_CONTINUATION) {
+        fragmentOpcode = opcode;
+        fragments.clear();
+      }
+      fragments.addAll(payload);
+      KJ_REQUIRE(fragments.size() <= maxMessageSize, "WebSocket message too large");
+      if (fin)
+        return Message{fragmentOpcode, fragments.releaseAsArray()};
+    }
+
+    // Drop consumed bytes before waiting for more.
+    if (pos > 0) {
+      kj::Vector<byte> rest(buffer.size() - pos);
+      rest.addAll(buffer.begin() + pos, buffer.end());
+      buffer = kj::mv(rest);
+      pos = 0;
+    }
+    return nullptr;
+  }
+
+ private:
+  const size_t maxMessageSize;
+  kj::Vector<byte> buffer;
+  size_t pos = 0;
+  kj::Vector<byte> fragments;
+  byte fragmentOpcode = WS_TEXT;
+};
+
 template <typename Pred>
 kj::String filteredString(Pred&& pred, kj::ArrayPtr<const char> input) {
   kj::Vector<char> ret(input.size() + 1);